@@ -0,0 +1,306 @@
+#include "ColorConverter.h"
+
+#define SAT(c) if (c & (~255)) { if (c < 0) c = 0; else c = 255; }
+#define FIX(x) ((int) ((x) * 65536.0 + ((x) < 0 ? -0.5 : 0.5)))
+
+/* Aim for each band's source and destination rows to sit in L2 together. */
+#define BAND_BYTES (256 * 1024)
+
+struct convertJob {
+    ColorConverter *converter;
+    bool nv12;
+    int width;
+    int height;
+    int rowsPerBand;
+    const unsigned char *src;
+    int srcStride;
+    const unsigned char *uv;
+    int uvStride;
+    unsigned char *dst;
+};
+
+ColorConverter::ColorConverter() {
+    matrix = COLOR_MATRIX_BT601;
+    range = COLOR_RANGE_LIMITED;
+    pool = NULL;
+    buildTables();
+}
+
+void ColorConverter::setMatrix(colorMatrix matrix) {
+    if (this->matrix != matrix) {
+        this->matrix = matrix;
+        buildTables();
+    }
+}
+
+colorMatrix ColorConverter::getMatrix() {
+    return matrix;
+}
+
+void ColorConverter::setRange(colorRange range) {
+    if (this->range != range) {
+        this->range = range;
+        buildTables();
+    }
+}
+
+colorRange ColorConverter::getRange() {
+    return range;
+}
+
+void ColorConverter::setFromFormat(unsigned int colorspace, unsigned int ycbcrEnc, unsigned int quantization) {
+    if (ycbcrEnc == V4L2_YCBCR_ENC_DEFAULT)
+        ycbcrEnc = V4L2_MAP_YCBCR_ENC_DEFAULT(colorspace);
+    if (quantization == V4L2_QUANTIZATION_DEFAULT)
+        quantization = V4L2_MAP_QUANTIZATION_DEFAULT(0, colorspace, ycbcrEnc);
+
+    switch (ycbcrEnc) {
+    case V4L2_YCBCR_ENC_709:
+    case V4L2_YCBCR_ENC_XV709:
+        matrix = COLOR_MATRIX_BT709;
+        break;
+
+    case V4L2_YCBCR_ENC_BT2020:
+    case V4L2_YCBCR_ENC_BT2020_CONST_LUM:
+        matrix = COLOR_MATRIX_BT2020;
+        break;
+
+    default:
+        matrix = COLOR_MATRIX_BT601;
+        break;
+    }
+
+    if (quantization == V4L2_QUANTIZATION_FULL_RANGE)
+        range = COLOR_RANGE_FULL;
+    else
+        range = COLOR_RANGE_LIMITED;
+
+    buildTables();
+}
+
+void ColorConverter::setWorkerPool(WorkerPool *pool) {
+    this->pool = pool;
+}
+
+WorkerPool *ColorConverter::getWorkerPool() {
+    return pool;
+}
+
+void ColorConverter::YUYVToRGB24(int width, int height, const unsigned char *src, int srcStride, unsigned char *dst) {
+    convertJob job;
+    int rows = bandRows(height, srcStride + width * 3);
+
+    if (rows >= height) {
+        YUYVRows(width, height, src, srcStride, dst);
+        return;
+    }
+
+    job.converter = this;
+    job.nv12 = false;
+    job.width = width;
+    job.height = height;
+    job.rowsPerBand = rows;
+    job.src = src;
+    job.srcStride = srcStride;
+    job.uv = NULL;
+    job.uvStride = 0;
+    job.dst = dst;
+    pool->run(convertBand, &job, (height + rows - 1) / rows);
+}
+
+void ColorConverter::NV12ToRGB24(int width, int height, const unsigned char *srcY, int yStride, const unsigned char *srcUV, int uvStride, unsigned char *dst) {
+    convertJob job;
+    int rows = bandRows(height, yStride + uvStride / 2 + width * 3);
+
+    if (rows >= height) {
+        NV12Rows(width, height, srcY, yStride, srcUV, uvStride, dst);
+        return;
+    }
+
+    job.converter = this;
+    job.nv12 = true;
+    job.width = width;
+    job.height = height;
+    job.rowsPerBand = rows;
+    job.src = srcY;
+    job.srcStride = yStride;
+    job.uv = srcUV;
+    job.uvStride = uvStride;
+    job.dst = dst;
+    pool->run(convertBand, &job, (height + rows - 1) / rows);
+}
+
+/*
+ * Rows per band: small enough to stay cache resident, but never so many that
+ * some threads go idle.  Always even so NV12 bands never split a chroma row.
+ */
+int ColorConverter::bandRows(int height, int bytesPerRow) {
+    int threads, rows, perThread;
+
+    if (!pool || (threads = pool->getNumThreads()) < 2)
+        return height;
+
+    rows = BAND_BYTES / bytesPerRow;
+    perThread = (height + threads - 1) / threads;
+    if (rows > perThread)
+        rows = perThread;
+
+    rows = (rows + 1) & ~1;
+    if (rows < 2)
+        rows = 2;
+
+    return rows;
+}
+
+void ColorConverter::convertBand(void *arg, int band) {
+    convertJob *job = (convertJob *) arg;
+    int first = band * job->rowsPerBand;
+    int rows = job->rowsPerBand;
+
+    if (first + rows > job->height)
+        rows = job->height - first;
+
+    if (job->nv12)
+        job->converter->NV12Rows(job->width, rows, job->src + first * job->srcStride, job->srcStride,
+            job->uv + (first >> 1) * job->uvStride, job->uvStride, job->dst + first * job->width * 3);
+    else
+        job->converter->YUYVRows(job->width, rows, job->src + first * job->srcStride, job->srcStride,
+            job->dst + first * job->width * 3);
+}
+
+void ColorConverter::buildTables() {
+    double kr, kb, kg, yScale, cScale;
+    int yOffset, i;
+
+    switch (matrix) {
+    case COLOR_MATRIX_BT709:
+        kr = 0.2126;
+        kb = 0.0722;
+        break;
+
+    case COLOR_MATRIX_BT2020:
+        kr = 0.2627;
+        kb = 0.0593;
+        break;
+
+    case COLOR_MATRIX_BT601:
+    default:
+        kr = 0.299;
+        kb = 0.114;
+        break;
+    }
+    kg = 1.0 - kr - kb;
+
+    if (range == COLOR_RANGE_LIMITED) {
+        yOffset = 16;
+        yScale = 255.0 / 219.0;
+        cScale = 255.0 / 224.0;
+    } else {
+        yOffset = 0;
+        yScale = 1.0;
+        cScale = 1.0;
+    }
+
+    for (i = 0; i < 256; i++) {
+        double c = (i - 128) * cScale;
+
+        /* Rounding is folded into the luma term so the kernel only shifts. */
+        yTable[i] = FIX((i - yOffset) * yScale) + (1 << 15);
+        crToR[i] = FIX(2.0 * (1.0 - kr) * c);
+        cbToB[i] = FIX(2.0 * (1.0 - kb) * c);
+        cbToG[i] = FIX(2.0 * kb * (1.0 - kb) / kg * c);
+        crToG[i] = FIX(2.0 * kr * (1.0 - kr) / kg * c);
+    }
+}
+
+void ColorConverter::YUYVRows(int width, int height, const unsigned char *src, int srcStride, unsigned char *dst) {
+    const unsigned char *s;
+    unsigned char *d;
+    int l, c;
+    int r, g, b, cr, cg, cb, y1, y2;
+
+    d = dst;
+    for (l = 0; l < height; l++) {
+        s = src + l * srcStride;
+        c = width >> 1;
+        while (c--) {
+            y1 = yTable[*s++];
+            cb = cbToB[*s];
+            cg = cbToG[*s++];
+            y2 = yTable[*s++];
+            cr = crToR[*s];
+            cg += crToG[*s++];
+
+            r = (y1 + cr) >> 16;
+            b = (y1 + cb) >> 16;
+            g = (y1 - cg) >> 16;
+            SAT(r);
+            SAT(g);
+            SAT(b);
+
+            *d++ = b;
+            *d++ = g;
+            *d++ = r;
+
+            r = (y2 + cr) >> 16;
+            b = (y2 + cb) >> 16;
+            g = (y2 - cg) >> 16;
+            SAT(r);
+            SAT(g);
+            SAT(b);
+
+            *d++ = b;
+            *d++ = g;
+            *d++ = r;
+        }
+    }
+}
+
+/*
+ * NV12 carries one interleaved CbCr pair per 2x2 block, so each chroma row is
+ * shared by two luma rows.  Y and CbCr may live in separate planes.
+ */
+void ColorConverter::NV12Rows(int width, int height, const unsigned char *srcY, int yStride, const unsigned char *srcUV, int uvStride, unsigned char *dst) {
+    const unsigned char *s;
+    const unsigned char *uv;
+    unsigned char *d;
+    int l, c;
+    int r, g, b, cr, cg, cb, y1, y2;
+
+    d = dst;
+    for (l = 0; l < height; l++) {
+        s = srcY + l * yStride;
+        uv = srcUV + (l >> 1) * uvStride;
+        c = width >> 1;
+        while (c--) {
+            y1 = yTable[*s++];
+            y2 = yTable[*s++];
+            cb = cbToB[*uv];
+            cg = cbToG[*uv++];
+            cr = crToR[*uv];
+            cg += crToG[*uv++];
+
+            r = (y1 + cr) >> 16;
+            b = (y1 + cb) >> 16;
+            g = (y1 - cg) >> 16;
+            SAT(r);
+            SAT(g);
+            SAT(b);
+
+            *d++ = b;
+            *d++ = g;
+            *d++ = r;
+
+            r = (y2 + cr) >> 16;
+            b = (y2 + cb) >> 16;
+            g = (y2 - cg) >> 16;
+            SAT(r);
+            SAT(g);
+            SAT(b);
+
+            *d++ = b;
+            *d++ = g;
+            *d++ = r;
+        }
+    }
+}
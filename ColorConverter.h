@@ -0,0 +1,57 @@
+#ifndef __COLORCONVERTER_H__
+#define __COLORCONVERTER_H__
+
+#include <linux/videodev2.h>
+
+#include "WorkerPool.h"
+
+enum colorMatrix {
+    COLOR_MATRIX_BT601,
+    COLOR_MATRIX_BT709,
+    COLOR_MATRIX_BT2020
+};
+
+enum colorRange {
+    COLOR_RANGE_LIMITED,
+    COLOR_RANGE_FULL
+};
+
+/*
+ * Y'CbCr to RGB conversion backed by per-component lookup tables.  The tables
+ * hold 16.16 fixed point contributions for every possible 8-bit sample so the
+ * matrix and range only cost something when they are changed, never per pixel.
+ * Given a worker pool, frames are split into bands of rows converted in
+ * parallel; the output is byte for byte the same as converting in one go.
+ */
+class ColorConverter {
+public:
+    ColorConverter();
+    void setMatrix(colorMatrix matrix);
+    colorMatrix getMatrix();
+    void setRange(colorRange range);
+    colorRange getRange();
+    void setFromFormat(unsigned int colorspace, unsigned int ycbcrEnc, unsigned int quantization);
+    void setWorkerPool(WorkerPool *pool);
+    WorkerPool *getWorkerPool();
+    void YUYVToRGB24(int width, int height, const unsigned char *src, int srcStride, unsigned char *dst);
+    void NV12ToRGB24(int width, int height, const unsigned char *srcY, int yStride, const unsigned char *srcUV, int uvStride, unsigned char *dst);
+
+private:
+    colorMatrix matrix;
+    colorRange range;
+    int yTable[256];
+    int crToR[256];
+    int cbToG[256];
+    int crToG[256];
+    int cbToB[256];
+    WorkerPool *pool;
+
+private:
+    void buildTables();
+    int bandRows(int height, int bytesPerRow);
+    void YUYVRows(int width, int height, const unsigned char *src, int srcStride, unsigned char *dst);
+    void NV12Rows(int width, int height, const unsigned char *srcY, int yStride, const unsigned char *srcUV, int uvStride, unsigned char *dst);
+    static void convertBand(void *arg, int band);
+};
+
+#endif
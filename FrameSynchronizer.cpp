@@ -0,0 +1,185 @@
+#include "FrameSynchronizer.h"
+#include "IOException.h"
+#include "StreamerMetrics.h"
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <sys/select.h>
+
+static long long toUsec(const struct timeval &tv) {
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+FrameSynchronizer::FrameSynchronizer(const vector<V4LStreamer *> &streamers, long long toleranceUsec) {
+    this->streamers = streamers;
+    tolerance = toleranceUsec;
+    heads.resize(streamers.size());
+    haveHead.assign(streamers.size(), false);
+    drops.assign(streamers.size(), 0);
+    totalDrops.assign(streamers.size(), 0);
+    memset(&lastError, 0, sizeof(lastError));
+}
+
+FrameSynchronizer::~FrameSynchronizer() {
+    for (size_t i = 0; i < streamers.size(); i++)
+        if (haveHead[i])
+            streamers[i]->tryReleaseFrame(heads[i]);
+}
+
+void FrameSynchronizer::setTolerance(long long toleranceUsec) {
+    tolerance = toleranceUsec;
+}
+
+long long FrameSynchronizer::getTolerance() {
+    return tolerance;
+}
+
+void FrameSynchronizer::nextSet(frameSet &set, int timeoutMs) {
+    if (STATUS_OK != tryNextSet(set, timeoutMs))
+        throw IOException(lastError);
+}
+
+void FrameSynchronizer::releaseSet(frameSet &set) {
+    if (STATUS_OK != tryReleaseSet(set))
+        throw IOException(lastError);
+}
+
+/*
+ * Waits up to timeoutMs for a matched set.  The frames in the set belong to
+ * the streamers' buffers and must be returned with releaseSet().
+ */
+streamerStatus FrameSynchronizer::tryNextSet(frameSet &set, int timeoutMs) {
+    unsigned long long deadline = StreamerMetrics::now() + (unsigned long long) timeoutMs * 1000000ULL;
+    unsigned long long now;
+    streamerStatus status;
+    long long newest, oldest, ts;
+    bool complete;
+    fd_set readFds;
+    struct timeval tv;
+    int maxFD, retval;
+    size_t i;
+
+    if (streamers.empty())
+        return fail(STATUS_UNSUPPORTED, 0, "No streamers to synchronise");
+
+    for (;;) {
+        for (i = 0; i < streamers.size(); i++) {
+            if (haveHead[i])
+                continue;
+
+            status = streamers[i]->tryDequeueFrame(heads[i]);
+            if (status == STATUS_OK)
+                haveHead[i] = true;
+            else if (status != STATUS_AGAIN)
+                return fail(status, streamers[i]->getLastError());
+        }
+
+        newest = oldest = 0;
+        complete = true;
+        for (i = 0; i < streamers.size(); i++) {
+            if (!haveHead[i]) {
+                complete = false;
+                continue;
+            }
+
+            ts = toUsec(heads[i].timestamp);
+            if (newest == 0 || ts > newest)
+                newest = ts;
+        }
+
+        /* Nothing older than this can ever be matched, so drop it now. */
+        for (i = 0; i < streamers.size(); i++) {
+            if (!haveHead[i])
+                continue;
+
+            ts = toUsec(heads[i].timestamp);
+            if (newest - ts > tolerance) {
+                haveHead[i] = false;
+                drops[i]++;
+                totalDrops[i]++;
+                complete = false;
+
+                if (STATUS_OK != (status = streamers[i]->tryReleaseFrame(heads[i])))
+                    return fail(status, streamers[i]->getLastError());
+            } else if (oldest == 0 || ts < oldest) {
+                oldest = ts;
+            }
+        }
+
+        if (complete) {
+            set.frames.assign(heads.begin(), heads.end());
+            set.drops.assign(drops.begin(), drops.end());
+            set.skewUsec = newest - oldest;
+
+            drops.assign(streamers.size(), 0);
+            haveHead.assign(streamers.size(), false);
+            return STATUS_OK;
+        }
+
+        now = StreamerMetrics::now();
+        if (now >= deadline)
+            return fail(STATUS_TIMEOUT, 0, "Timed out waiting for a matched frame set");
+
+        FD_ZERO(&readFds);
+        maxFD = -1;
+        for (i = 0; i < streamers.size(); i++) {
+            if (haveHead[i])
+                continue;
+
+            FD_SET(streamers[i]->getFileDescriptor(), &readFds);
+            if (streamers[i]->getFileDescriptor() > maxFD)
+                maxFD = streamers[i]->getFileDescriptor();
+        }
+
+        /* Every camera already has a frame, go round and match again. */
+        if (maxFD < 0)
+            continue;
+
+        tv.tv_sec = (deadline - now) / 1000000000ULL;
+        tv.tv_usec = ((deadline - now) % 1000000000ULL) / 1000;
+
+        retval = select(maxFD + 1, &readFds, NULL, NULL, &tv);
+        if (retval == -1 && errno != EINTR)
+            return fail(STATUS_IO_ERROR, errno, "Select error");
+        if (retval == 0)
+            return fail(STATUS_TIMEOUT, 0, "Timed out waiting for a matched frame set");
+    }
+}
+
+streamerStatus FrameSynchronizer::tryReleaseSet(frameSet &set) {
+    streamerStatus status = STATUS_OK, released;
+
+    for (size_t i = 0; i < set.frames.size() && i < streamers.size(); i++)
+        if (STATUS_OK != (released = streamers[i]->tryReleaseFrame(set.frames[i])))
+            status = fail(released, streamers[i]->getLastError());
+
+    set.frames.clear();
+    return status;
+}
+
+const vector<unsigned long long> &FrameSynchronizer::getTotalDrops() {
+    return totalDrops;
+}
+
+const streamerError &FrameSynchronizer::getLastError() {
+    return lastError;
+}
+
+streamerStatus FrameSynchronizer::fail(streamerStatus status, int err, const char *message) {
+    lastError.status = status;
+    lastError.sysErrno = err;
+    lastError.operation = "sync";
+    snprintf(lastError.message, sizeof(lastError.message), "%s", message);
+    return status;
+}
+
+/*
+ * Takes the status the streamer actually returned rather than trusting its
+ * descriptor, which may be stale.
+ */
+streamerStatus FrameSynchronizer::fail(streamerStatus status, const streamerError &err) {
+    lastError = err;
+    lastError.status = status;
+    return status;
+}
@@ -0,0 +1,55 @@
+#ifndef __FRAMESYNCHRONIZER_H__
+#define __FRAMESYNCHRONIZER_H__
+
+#include <vector>
+
+#include "v4lstreamer.h"
+#include "StreamerError.h"
+
+using namespace std;
+
+/*
+ * One frame from every camera, in the order the streamers were given.  drops
+ * counts the frames discarded per camera since the previous set.
+ */
+struct frameSet {
+    vector<frameView> frames;
+    long long skewUsec;
+    vector<unsigned long> drops;
+};
+
+/*
+ * Groups frames from several streamers by driver timestamp.  A frame is kept
+ * until every other camera has one within the tolerance of it; anything that
+ * falls behind the newest frame by more than that is handed straight back to
+ * its driver without being copied.  All streamers must be capturing, use the
+ * same timestamp clock and have at least two buffers.
+ */
+class FrameSynchronizer {
+public:
+    FrameSynchronizer(const vector<V4LStreamer *> &streamers, long long toleranceUsec);
+    ~FrameSynchronizer();
+    void setTolerance(long long toleranceUsec);
+    long long getTolerance();
+    void nextSet(frameSet &set, int timeoutMs);
+    void releaseSet(frameSet &set);
+    streamerStatus tryNextSet(frameSet &set, int timeoutMs);
+    streamerStatus tryReleaseSet(frameSet &set);
+    const vector<unsigned long long> &getTotalDrops();
+    const streamerError &getLastError();
+
+private:
+    vector<V4LStreamer *> streamers;
+    vector<frameView> heads;
+    vector<bool> haveHead;
+    vector<unsigned long> drops;
+    vector<unsigned long long> totalDrops;
+    long long tolerance;
+    streamerError lastError;
+
+private:
+    streamerStatus fail(streamerStatus status, int err, const char *message);
+    streamerStatus fail(streamerStatus status, const streamerError &err);
+};
+
+#endif
@@ -3,11 +3,24 @@
 #include <cstdio>
 
 IOException::IOException() {
-    str = "Unspecified";
+    snprintf(str, sizeof(str), "%s", "Unspecified");
+    error.status = STATUS_IO_ERROR;
+    error.sysErrno = 0;
+    error.operation = "";
+    snprintf(error.message, sizeof(error.message), "%s", str);
 }
 
 IOException::IOException(const char *exp) {
-    str = exp;
+    snprintf(str, sizeof(str), "%s", exp);
+    error.status = STATUS_IO_ERROR;
+    error.sysErrno = 0;
+    error.operation = "";
+    snprintf(error.message, sizeof(error.message), "%s", str);
+}
+
+IOException::IOException(const streamerError &err) {
+    error = err;
+    snprintf(str, sizeof(str), "%s", err.message);
 }
 
 const char *IOException::what() const throw() {
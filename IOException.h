@@ -3,17 +3,20 @@
 
 #include <exception>
 
+#include "StreamerError.h"
+
 using namespace std;
 
 class IOException: public exception {
 public:
-    const char *str;
+    char str[256];
+    streamerError error;
 
 public:
     IOException();
     IOException(const char *exp);
+    IOException(const streamerError &err);
     virtual const char *what() const throw();
 };
 
 #endif
-
@@ -0,0 +1,61 @@
+#include "ParallelOpen.h"
+#include "IOException.h"
+#include "StreamerMetrics.h"
+
+#include <cstdio>
+#include <new>
+#include <pthread.h>
+
+struct openJob {
+    const streamerConfig *config;
+    openResult *result;
+};
+
+static void *openDevice(void *arg) {
+    openJob *job = (openJob *) arg;
+    const streamerConfig &c = *job->config;
+    openResult &r = *job->result;
+    unsigned long long start = StreamerMetrics::now();
+
+    r.streamer = NULL;
+    r.error[0] = '\0';
+
+    try {
+        r.streamer = new V4LStreamer(c.io, c.deviceName, c.RGB, c.width, c.height, c.channel, c.numBuffers, c.pixelFormat, c.field, c.std);
+    } catch (IOException &e) {
+        snprintf(r.error, sizeof(r.error), "%s", e.what());
+    } catch (bad_alloc &e) {
+        snprintf(r.error, sizeof(r.error), "%s: out of memory", c.deviceName.c_str());
+    }
+
+    r.startupSeconds = (StreamerMetrics::now() - start) * 1e-9;
+    return NULL;
+}
+
+/*
+ * Opens and configures every device on its own thread.  Most of the bring-up
+ * time is spent waiting in driver ioctls, so a rack of cameras comes up in
+ * roughly the time of the slowest one rather than the sum of all of them.
+ */
+void openStreamers(const vector<streamerConfig> &configs, vector<openResult> &results) {
+    vector<openJob> jobs(configs.size());
+    vector<pthread_t> threads(configs.size());
+    vector<bool> started(configs.size(), false);
+    size_t i;
+
+    results.resize(configs.size());
+
+    for (i = 0; i < configs.size(); i++) {
+        jobs[i].config = &configs[i];
+        jobs[i].result = &results[i];
+        started[i] = (0 == pthread_create(&threads[i], NULL, openDevice, &jobs[i]));
+
+        /* Out of threads: bring this one up inline instead. */
+        if (!started[i])
+            openDevice(&jobs[i]);
+    }
+
+    for (i = 0; i < configs.size(); i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+}
@@ -0,0 +1,34 @@
+#ifndef __PARALLELOPEN_H__
+#define __PARALLELOPEN_H__
+
+#include <string>
+#include <vector>
+
+#include "v4lstreamer.h"
+
+using namespace std;
+
+/* Mirrors the V4LStreamer constructor arguments. */
+struct streamerConfig {
+    ioMethod io;
+    string deviceName;
+    bool RGB;
+    int width;
+    int height;
+    int channel;
+    int numBuffers;
+    unsigned int pixelFormat;
+    v4l2_field field;
+    v4l2_std_id std;
+};
+
+/* streamer is NULL when the device failed to open, with the reason in error. */
+struct openResult {
+    V4LStreamer *streamer;
+    double startupSeconds;
+    char error[256];
+};
+
+void openStreamers(const vector<streamerConfig> &configs, vector<openResult> &results);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __STREAMERERROR_H__
+#define __STREAMERERROR_H__
+
+enum streamerStatus {
+    STATUS_OK,
+    STATUS_AGAIN,
+    STATUS_TIMEOUT,
+    STATUS_NOT_STREAMING,
+    STATUS_IO_ERROR,
+    STATUS_UNSUPPORTED
+};
+
+/*
+ * Preallocated error descriptor.  Each streamer owns one and fills it in place
+ * on failure, so reporting an error never allocates.
+ */
+struct streamerError {
+    streamerStatus status;
+    int sysErrno;
+    const char *operation;
+    char message[256];
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "StreamerMetrics.h"
+#include "IOException.h"
+
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define BUMP(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+
+static const char *stageNames[NUM_STAGES] = {
+    "select",
+    "dqbuf",
+    "qbuf",
+    "read",
+    "copy",
+    "convert"
+};
+
+static const char *counterNames[NUM_COUNTERS] = {
+    "frames",
+    "eagain",
+    "timeouts",
+    "select_errors",
+    "eio",
+    "decimated"
+};
+
+StreamerMetrics::StreamerMetrics() {
+    reset();
+}
+
+void StreamerMetrics::count(metricsCounter counter) {
+    BUMP(counters[counter], 1);
+}
+
+void StreamerMetrics::record(metricsStage stage, unsigned long long ns) {
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    if (bucket >= METRICS_BUCKETS)
+        bucket = METRICS_BUCKETS - 1;
+
+    BUMP(buckets[stage][bucket], 1);
+    BUMP(counts[stage], 1);
+    BUMP(sumNs[stage], ns);
+}
+
+void StreamerMetrics::reset() {
+    int i, j;
+
+    for (i = 0; i < NUM_COUNTERS; i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+
+    for (i = 0; i < NUM_STAGES; i++) {
+        for (j = 0; j < METRICS_BUCKETS; j++)
+            __atomic_store_n(&buckets[i][j], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counts[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&sumNs[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void StreamerMetrics::snapshot(metricsSnapshot &snap) {
+    int i, j;
+
+    for (i = 0; i < NUM_COUNTERS; i++)
+        snap.counters[i] = LOAD(counters[i]);
+
+    for (i = 0; i < NUM_STAGES; i++) {
+        for (j = 0; j < METRICS_BUCKETS; j++)
+            snap.buckets[i][j] = LOAD(buckets[i][j]);
+        snap.count[i] = LOAD(counts[i]);
+        snap.sumNs[i] = LOAD(sumNs[i]);
+    }
+}
+
+string StreamerMetrics::toPrometheus(const string &device) {
+    metricsSnapshot snap;
+    string out;
+    char line[256];
+    int i, j;
+
+    snapshot(snap);
+
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        snprintf(line, sizeof(line), "# TYPE v4lstreamer_%s_total counter\n", counterNames[i]);
+        out += line;
+        snprintf(line, sizeof(line), "v4lstreamer_%s_total{device=\"%s\"} %llu\n", counterNames[i], device.c_str(), snap.counters[i]);
+        out += line;
+    }
+
+    out += "# TYPE v4lstreamer_stage_seconds histogram\n";
+    for (i = 0; i < NUM_STAGES; i++) {
+        unsigned long long cumulative = 0;
+
+        for (j = 0; j < METRICS_BUCKETS - 1; j++) {
+            cumulative += snap.buckets[i][j];
+            snprintf(line, sizeof(line), "v4lstreamer_stage_seconds_bucket{device=\"%s\",stage=\"%s\",le=\"%.9g\"} %llu\n",
+                device.c_str(), stageNames[i], (double) (1ULL << j) * 1e-9, cumulative);
+            out += line;
+        }
+
+        /*
+         * counts[] is loaded apart from the buckets and may lag them under
+         * concurrent record() calls; derive the total from the buckets so the
+         * series stays monotonic.
+         */
+        cumulative += snap.buckets[i][METRICS_BUCKETS - 1];
+        snprintf(line, sizeof(line), "v4lstreamer_stage_seconds_bucket{device=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n",
+            device.c_str(), stageNames[i], cumulative);
+        out += line;
+        snprintf(line, sizeof(line), "v4lstreamer_stage_seconds_sum{device=\"%s\",stage=\"%s\"} %.9f\n",
+            device.c_str(), stageNames[i], snap.sumNs[i] * 1e-9);
+        out += line;
+        snprintf(line, sizeof(line), "v4lstreamer_stage_seconds_count{device=\"%s\",stage=\"%s\"} %llu\n",
+            device.c_str(), stageNames[i], cumulative);
+        out += line;
+    }
+
+    return out;
+}
+
+/*
+ * Written to a temporary file and renamed into place so a textfile collector
+ * scraping the directory never sees a partial file.
+ */
+void StreamerMetrics::writePrometheus(const string &path, const string &device) {
+    string tmpPath = path + ".tmp";
+    string text = toPrometheus(device);
+    FILE *fp;
+
+    fp = fopen(tmpPath.c_str(), "w");
+    if (!fp)
+        throw IOException("Unable to open metrics file");
+
+    if (fwrite(text.data(), 1, text.size(), fp) != text.size()) {
+        fclose(fp);
+        throw IOException("Unable to write metrics file");
+    }
+
+    if (fclose(fp) != 0 || rename(tmpPath.c_str(), path.c_str()) != 0)
+        throw IOException("Unable to write metrics file");
+}
+
+unsigned long long StreamerMetrics::now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
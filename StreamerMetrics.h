@@ -0,0 +1,64 @@
+#ifndef __STREAMERMETRICS_H__
+#define __STREAMERMETRICS_H__
+
+#include <string>
+
+using namespace std;
+
+#define METRICS_BUCKETS 32
+
+enum metricsStage {
+    STAGE_SELECT,
+    STAGE_DQBUF,
+    STAGE_QBUF,
+    STAGE_READ,
+    STAGE_COPY,
+    STAGE_CONVERT,
+    NUM_STAGES
+};
+
+enum metricsCounter {
+    COUNTER_FRAMES,
+    COUNTER_EAGAIN,
+    COUNTER_TIMEOUTS,
+    COUNTER_SELECT_ERRORS,
+    COUNTER_EIO,
+    COUNTER_DECIMATED,
+    NUM_COUNTERS
+};
+
+/*
+ * Plain copy of the metrics at one instant.  Bucket i counts samples that took
+ * less than 2^i nanoseconds, the last bucket catches everything slower.
+ */
+struct metricsSnapshot {
+    unsigned long long counters[NUM_COUNTERS];
+    unsigned long long buckets[NUM_STAGES][METRICS_BUCKETS];
+    unsigned long long count[NUM_STAGES];
+    unsigned long long sumNs[NUM_STAGES];
+};
+
+/*
+ * Per-streamer counters and log2 latency histograms.  Updates are relaxed
+ * atomic increments so recording from the capture loop costs a few
+ * nanoseconds and readers never block the writer.
+ */
+class StreamerMetrics {
+public:
+    StreamerMetrics();
+    void count(metricsCounter counter);
+    void record(metricsStage stage, unsigned long long ns);
+    void reset();
+    void snapshot(metricsSnapshot &snap);
+    string toPrometheus(const string &device);
+    void writePrometheus(const string &path, const string &device);
+    static unsigned long long now();
+
+private:
+    unsigned long long counters[NUM_COUNTERS];
+    unsigned long long buckets[NUM_STAGES][METRICS_BUCKETS];
+    unsigned long long counts[NUM_STAGES];
+    unsigned long long sumNs[NUM_STAGES];
+};
+
+#endif
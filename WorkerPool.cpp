@@ -0,0 +1,113 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(int numThreads) {
+    pthread_t thread;
+
+    task = NULL;
+    taskArg = NULL;
+    taskCount = 0;
+    nextTask = 0;
+    active = 0;
+    generation = 0;
+    quit = false;
+
+    pthread_mutex_init(&runLock, NULL);
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wake, NULL);
+    pthread_cond_init(&idle, NULL);
+
+    /* The caller of run() does its share, so it counts as one of the threads. */
+    for (int i = 1; i < numThreads; i++) {
+        if (0 != pthread_create(&thread, NULL, workerMain, this))
+            break;
+        threads.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+    pthread_mutex_destroy(&runLock);
+}
+
+int WorkerPool::getNumThreads() {
+    return threads.size() + 1;
+}
+
+void WorkerPool::run(workerTask task, void *arg, int count) {
+    /*
+     * The task fields and nextTask describe a single batch, so a second
+     * caller has to wait until the first batch has fully drained.
+     */
+    pthread_mutex_lock(&runLock);
+    pthread_mutex_lock(&lock);
+
+    /* A worker that woke late for the last batch may still be on its way out. */
+    while (active > 0)
+        pthread_cond_wait(&idle, &lock);
+
+    this->task = task;
+    taskArg = arg;
+    taskCount = count;
+    nextTask = 0;
+    generation++;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+
+    work(task, arg, count);
+
+    pthread_mutex_lock(&lock);
+    while (active > 0)
+        pthread_cond_wait(&idle, &lock);
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&runLock);
+}
+
+void WorkerPool::work(workerTask task, void *arg, int count) {
+    int index;
+
+    while ((index = __atomic_fetch_add(&nextTask, 1, __ATOMIC_RELAXED)) < count)
+        task(arg, index);
+}
+
+void *WorkerPool::workerMain(void *arg) {
+    WorkerPool *pool = (WorkerPool *) arg;
+    unsigned long seen = 0;
+    workerTask task;
+    void *taskArg;
+    int count;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && seen == pool->generation)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+
+        if (pool->quit)
+            break;
+
+        seen = pool->generation;
+        task = pool->task;
+        taskArg = pool->taskArg;
+        count = pool->taskCount;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->work(task, taskArg, count);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
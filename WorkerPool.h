@@ -0,0 +1,46 @@
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#include <vector>
+#include <pthread.h>
+
+using namespace std;
+
+typedef void (*workerTask)(void *arg, int index);
+
+/*
+ * Fixed set of threads kept alive for the life of the pool.  run() hands out
+ * task indices to the workers and the calling thread alike and returns once
+ * every index has been processed, so nothing is created per call.
+ *
+ * run() may be called from several threads; calls are serialised, so one
+ * pool shared between streamers processes one batch at a time.  A task must
+ * not call run() on its own pool.
+ */
+class WorkerPool {
+public:
+    WorkerPool(int numThreads);
+    ~WorkerPool();
+    int getNumThreads();
+    void run(workerTask task, void *arg, int count);
+
+private:
+    vector<pthread_t> threads;
+    pthread_mutex_t runLock;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    workerTask task;
+    void *taskArg;
+    int taskCount;
+    int nextTask;
+    int active;
+    unsigned long generation;
+    bool quit;
+
+private:
+    static void *workerMain(void *arg);
+    void work(workerTask task, void *arg, int count);
+};
+
+#endif
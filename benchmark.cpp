@@ -0,0 +1,100 @@
+#include "ColorConverter.h"
+#include "StreamerMetrics.h"
+#include "WorkerPool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+
+struct resolution {
+    int width;
+    int height;
+};
+
+static double timeConversion(ColorConverter &converter, bool nv12, int width, int height, unsigned char *src, unsigned char *dst, int numFrames) {
+    unsigned long long start = StreamerMetrics::now();
+
+    for (int i = 0; i < numFrames; i++) {
+        if (nv12)
+            converter.NV12ToRGB24(width, height, src, width, src + width * height, width, dst);
+        else
+            converter.YUYVToRGB24(width, height, src, width * 2, dst);
+    }
+
+    return (StreamerMetrics::now() - start) * 1e-6 / numFrames;
+}
+
+int main(int argc, char **argv) {
+    int c, numFrames = 50, maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    resolution sizes[] = { {640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160} };
+    ColorConverter converter;
+
+    while ((c = getopt(argc, argv, "n:t:h")) != -1) {
+        switch (c) {
+        case 'n':
+            numFrames = atoi(optarg);
+            break;
+        case 't':
+            maxThreads = atoi(optarg);
+            break;
+        case 'h':
+        default :
+            printf("Useage:  benchmark -n <frames per run> -t <max threads>\n");
+            return 1;
+        }
+    }
+
+    printf("%-5s %-10s %7s %10s %8s %8s\n", "fmt", "size", "threads", "ms/frame", "fps", "speedup");
+
+    for (int f = 0; f < 2; f++) {
+        bool nv12 = (f == 1);
+
+        for (size_t r = 0; r < sizeof(sizes) / sizeof(sizes[0]); r++) {
+            int width = sizes[r].width, height = sizes[r].height;
+            int srcSize = nv12 ? width * height * 3 / 2 : width * height * 2;
+            unsigned char *src = new unsigned char[srcSize];
+            unsigned char *reference = new unsigned char[width * height * 3];
+            unsigned char *dst = new unsigned char[width * height * 3];
+            double single = 0;
+            char size[32];
+
+            srand(r);
+            for (int i = 0; i < srcSize; i++)
+                src[i] = rand();
+            snprintf(size, sizeof(size), "%dx%d", width, height);
+
+            converter.setWorkerPool(NULL);
+            if (nv12)
+                converter.NV12ToRGB24(width, height, src, width, src + width * height, width, reference);
+            else
+                converter.YUYVToRGB24(width, height, src, width * 2, reference);
+
+            for (int threads = 1; threads <= maxThreads; threads++) {
+                WorkerPool pool(threads);
+                double ms;
+
+                converter.setWorkerPool(&pool);
+                ms = timeConversion(converter, nv12, width, height, src, dst, numFrames);
+                converter.setWorkerPool(NULL);
+
+                if (memcmp(dst, reference, width * height * 3) != 0) {
+                    printf("%s %s: output with %d threads differs from single-threaded\n", nv12 ? "NV12" : "YUYV", size, threads);
+                    return 1;
+                }
+
+                if (threads == 1)
+                    single = ms;
+
+                printf("%-5s %-10s %7d %10.3f %8.1f %8.2f\n", nv12 ? "NV12" : "YUYV", size, threads, ms, 1000.0 / ms, single / ms);
+            }
+
+            delete[] src;
+            delete[] reference;
+            delete[] dst;
+        }
+    }
+
+    return 0;
+}
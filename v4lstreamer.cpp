@@ -1,23 +1,69 @@
 #include "v4lstreamer.h"
 #include "IOException.h"
 
+#include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <map>
+#include <vector>
+#include <pthread.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <malloc.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <asm/types.h>
 
-#define SAT(c) if (c & (~255)) { if (c < 0) c = 0; else c = 255; }
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
+#define EIO_RESTART_THRESHOLD 8
+
+/*
+ * What we learned about a device the last time it was opened, keyed by
+ * driver, card, bus_info and the node's device number.  The device number is
+ * needed because multi-node devices such as ISPs report identical driver,
+ * card and bus_info on every capture node, yet each node has its own formats.
+ */
+struct formatEntry {
+    struct v4l2_format request;
+    struct v4l2_format result;
+};
+
+struct deviceProfile {
+    bool cropProbed;
+    bool cropSupported;
+    struct v4l2_cropcap cropcap;
+    vector<formatEntry> formats;
+    map<unsigned int, v4l2_std_id> inputStds;
+};
+
+static map<string, deviceProfile> profiles;
+static pthread_mutex_t profilesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Packed 4:2:2 is the only layout where two bytes per pixel is a safe lower
+ * bound for drivers that leave bytesperline or sizeimage at zero.  Anything
+ * else, NV12 included, has to be taken as the driver reports it.
+ */
+static bool isPacked422(unsigned int format) {
+    switch (format) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_VYUY:
+        return true;
+
+    default:
+        return false;
+    }
+}
 
 V4LStreamer::V4LStreamer(ioMethod ioMeth, string devName, bool RGBval, int width, int height, int channel, int numBuffers, unsigned int pixelFormat, v4l2_field field, v4l2_std_id std) {
     streaming = false;
@@ -27,6 +73,19 @@ V4LStreamer::V4LStreamer(ioMethod ioMeth, string devName, bool RGBval, int width
     cameraFD = -1;
     FD_ZERO(&fds);
     this->numBuffers = numBuffers;
+    numPlanes = 1;
+    bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffers = NULL;
+    decimation = DECIMATE_NONE;
+    decimateEvery = 1;
+    decimatePeriod = 0;
+    nextDeadline = -1;
+    frameCounter = 0;
+    rateLowered = false;
+    CLEAR(savedTimePerFrame);
+    eioStreak = 0;
+    CLEAR(lastError);
+    conversionPool = NULL;
     CLEAR(cap);
     CLEAR(cropcap);
     CLEAR(crop);
@@ -38,29 +97,13 @@ V4LStreamer::V4LStreamer(ioMethod ioMeth, string devName, bool RGBval, int width
 
 V4LStreamer::~V4LStreamer() {
     if (streaming) {
-        stopCapture();
-    } else {
-        unsigned int i;
-
-        switch (io) {
-        case IO_METHOD_READ:
-            free (buffers[0].start);
-            break;
+        tryStopCapture();
+    }
 
-        case IO_METHOD_MMAP:
-            for (i = 0; i < numBuffers; ++i)
-                if (-1 == munmap (buffers[i].start, buffers[i].length))
-                    throw IOException("munmap");
-            break;
+    freeBuffers();
 
-        case IO_METHOD_USERPTR:
-            for (i = 0; i < numBuffers; ++i)
-                free (buffers[i].start);
-            break;
-        }   
-
-    free (buffers);  
-    }
+    converter.setWorkerPool(NULL);
+    delete conversionPool;
 }
 
 void V4LStreamer::setRGB(bool RGBval) {
@@ -74,12 +117,22 @@ bool V4LStreamer::getRGB() {
 void V4LStreamer::setResolution(int width, int height) {
     if (!streaming) {
         unsigned int min;
-        fmt.fmt.pix.width = width; 
-        fmt.fmt.pix.height = height;
+
+        if (isMultiPlanar()) {
+            fmt.fmt.pix_mp.width = width;
+            fmt.fmt.pix_mp.height = height;
+        } else {
+            fmt.fmt.pix.width = width; 
+            fmt.fmt.pix.height = height;
+        }
     
         if (-1 == xioctl (cameraFD, VIDIOC_S_FMT, &fmt))
             throw IOException("VIDIOC_S_FMT: Failed to set resolution");
 
+        /* Multi-planar drivers always fill in the per-plane sizes. */
+        if (isMultiPlanar() || !isPacked422(fmt.fmt.pix.pixelformat))
+            return;
+
         min = fmt.fmt.pix.width * 2;
         if (fmt.fmt.pix.bytesperline < min)
             fmt.fmt.pix.bytesperline = min;
@@ -90,13 +143,23 @@ void V4LStreamer::setResolution(int width, int height) {
 }
 
 void V4LStreamer::getResolution(int &width, int &height) {
-    width = fmt.fmt.pix.width;
-    height = fmt.fmt.pix.height;
+    if (isMultiPlanar()) {
+        width = fmt.fmt.pix_mp.width;
+        height = fmt.fmt.pix_mp.height;
+    } else {
+        width = fmt.fmt.pix.width;
+        height = fmt.fmt.pix.height;
+    }
 }
 
 void V4LStreamer::setChannel(int channel) {
+    int current;
+
     if (!streaming) {
         input.index = channel;
+        /* Switching inputs can reset the format, skip it if already there. */
+        if (0 == xioctl (cameraFD, VIDIOC_G_INPUT, &current) && current == channel)
+            return;
         //if (-1 == xioctl (cameraFD, VIDIOC_ENUMINPUT, &input)) 
         //    throw IOException("VIDIOC_ENUMINPUT: Unable to set channel");
         if (-1 == xioctl (cameraFD, VIDIOC_S_INPUT, &channel)) 
@@ -109,40 +172,173 @@ int V4LStreamer::getChannel() {
 }
 
 void V4LStreamer::setStd(v4l2_std_id std) {
+    map<unsigned int, v4l2_std_id>::iterator it;
+    bool cached = false;
+
     memset (&input, 0, sizeof (input));
 
     if (-1 == ioctl (cameraFD, VIDIOC_G_INPUT, &input.index))
         throw IOException("VIDIOC_G_INPUT query error");
-    if (-1 == ioctl (cameraFD, VIDIOC_ENUMINPUT, &input))
-        throw IOException("VIDIOC_ENUM_INPUT query error");
+
+    pthread_mutex_lock(&profilesLock);
+    map<unsigned int, v4l2_std_id> &inputStds = profiles[profileKey].inputStds;
+    it = inputStds.find(input.index);
+    if (it != inputStds.end()) {
+        input.std = it->second;
+        cached = true;
+    }
+    pthread_mutex_unlock(&profilesLock);
+
+    if (!cached) {
+        if (-1 == ioctl (cameraFD, VIDIOC_ENUMINPUT, &input))
+            throw IOException("VIDIOC_ENUM_INPUT query error");
+
+        pthread_mutex_lock(&profilesLock);
+        profiles[profileKey].inputStds[input.index] = input.std;
+        pthread_mutex_unlock(&profilesLock);
+    }
     if (0 == (input.std & std))
         throw IOException("Unsupported video standard");
     if (-1 == ioctl (cameraFD, VIDIOC_S_STD, &std)) 
         throw IOException("Standard configuration error");
 }
 
+/*
+ * Sets resolution, pixel format and field in one go.  The request is checked
+ * with VIDIOC_TRY_FMT, which does not touch the hardware, and then applied
+ * with a single VIDIOC_S_FMT.  A request this device already validated skips
+ * the check altogether.
+ */
+void V4LStreamer::applyFormat(int width, int height, unsigned int pixelFormat, v4l2_field field) {
+    struct v4l2_format request;
+    bool cached = false;
+
+    if (streaming)
+        return;
+
+    if (isMultiPlanar()) {
+        fmt.fmt.pix_mp.width = width;
+        fmt.fmt.pix_mp.height = height;
+        fmt.fmt.pix_mp.pixelformat = pixelFormat;
+        fmt.fmt.pix_mp.field = field;
+    } else {
+        fmt.fmt.pix.width = width;
+        fmt.fmt.pix.height = height;
+        fmt.fmt.pix.pixelformat = pixelFormat;
+        fmt.fmt.pix.field = field;
+    }
+    request = fmt;
+
+    pthread_mutex_lock(&profilesLock);
+    vector<formatEntry> &formats = profiles[profileKey].formats;
+    for (size_t i = 0; i < formats.size(); i++) {
+        if (0 == memcmp(&formats[i].request, &request, sizeof(request))) {
+            fmt = formats[i].result;
+            cached = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&profilesLock);
+
+    if (!cached && 0 == xioctl (cameraFD, VIDIOC_TRY_FMT, &fmt)) {
+        if ((unsigned int) getPixelFormat() != pixelFormat) {
+            fail(STATUS_UNSUPPORTED, 0, "VIDIOC_TRY_FMT", "%s does not support the requested pixel format", deviceName.c_str());
+            throw IOException(lastError);
+        }
+    } else if (!cached) {
+        /* Old drivers lack TRY_FMT, let S_FMT sort it out. */
+        fmt = request;
+    }
+
+    if (-1 == xioctl (cameraFD, VIDIOC_S_FMT, &fmt))
+        throw IOException("VIDIOC_S_FMT: Unable to set format");
+
+    if (!cached) {
+        formatEntry entry;
+
+        entry.request = request;
+        entry.result = fmt;
+
+        pthread_mutex_lock(&profilesLock);
+        profiles[profileKey].formats.push_back(entry);
+        pthread_mutex_unlock(&profilesLock);
+    }
+}
+
+void V4LStreamer::flushDeviceCache() {
+    pthread_mutex_lock(&profilesLock);
+    profiles.clear();
+    pthread_mutex_unlock(&profilesLock);
+}
+
 void V4LStreamer::setPixelFormat(unsigned int format) {
     if (!streaming) {
-        fmt.fmt.pix.pixelformat = format;
+        if (isMultiPlanar())
+            fmt.fmt.pix_mp.pixelformat = format;
+        else
+            fmt.fmt.pix.pixelformat = format;
         if (-1 == xioctl (cameraFD, VIDIOC_S_FMT, &fmt))
             throw IOException("VIDIOC_S_FMT: Unable to set pixel format");
     }
 }
 
 int V4LStreamer::getPixelFormat() {
+    if (isMultiPlanar())
+        return fmt.fmt.pix_mp.pixelformat;
     return fmt.fmt.pix.pixelformat;
 }
 
 void V4LStreamer::setField(v4l2_field field) {
     if (!streaming) {
-        fmt.fmt.pix.field = field;
+        if (isMultiPlanar())
+            fmt.fmt.pix_mp.field = field;
+        else
+            fmt.fmt.pix.field = field;
         if (-1 == xioctl (cameraFD, VIDIOC_S_FMT, &fmt))
             throw IOException("VIDIOC_ENUMINPUT: Unable to set field");
     }
 }
 
 v4l2_field V4LStreamer::getField() {
-    return fmt.fmt.pix.field;
+    if (isMultiPlanar())
+        return (v4l2_field) fmt.fmt.pix_mp.field;
+    return (v4l2_field) fmt.fmt.pix.field;
+}
+
+void V4LStreamer::setColorMatrix(colorMatrix matrix) {
+    converter.setMatrix(matrix);
+}
+
+colorMatrix V4LStreamer::getColorMatrix() {
+    return converter.getMatrix();
+}
+
+void V4LStreamer::setColorRange(colorRange range) {
+    converter.setRange(range);
+}
+
+colorRange V4LStreamer::getColorRange() {
+    return converter.getRange();
+}
+
+/*
+ * Spreads RGB conversion over numThreads threads, counting the one calling
+ * readFrame().  The pool lives until the next change, so no threads are
+ * created per frame.
+ */
+void V4LStreamer::setConversionThreads(int numThreads) {
+    converter.setWorkerPool(NULL);
+    delete conversionPool;
+    conversionPool = NULL;
+
+    if (numThreads > 1) {
+        conversionPool = new WorkerPool(numThreads);
+        converter.setWorkerPool(conversionPool);
+    }
+}
+
+int V4LStreamer::getConversionThreads() {
+    return conversionPool ? conversionPool->getNumThreads() : 1;
 }
 
 //void V4LStreamer::setNumBuffers(int numBuffers) {
@@ -153,73 +349,117 @@ int V4LStreamer::getNumbuffers() {
     return numBuffers;
 }
 
+int V4LStreamer::getFileDescriptor() {
+    return cameraFD;
+}
+
 
 int V4LStreamer::getImageSize() {
+    if (isMultiPlanar()) {
+        int size = 0;
+
+        for (unsigned int p = 0; p < numPlanes; ++p)
+            size += fmt.fmt.pix_mp.plane_fmt[p].sizeimage;
+        return size;
+    }
     return fmt.fmt.pix.sizeimage;
 }
 
 int V4LStreamer::getBytesPerLine() {
+    if (isMultiPlanar())
+        return fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
     return fmt.fmt.pix.bytesperline;
 }
 
-void V4LStreamer::startCapture() {
-    unsigned int i;
-    enum v4l2_buf_type type;
+bool V4LStreamer::isMultiPlanar() {
+    return bufType == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+}
 
-    switch (io) {
-    case IO_METHOD_READ:
-        /* Nothing to do. */
-        break;
+int V4LStreamer::getNumPlanes() {
+    return numPlanes;
+}
 
-    case IO_METHOD_MMAP:
-        for (i = 0; i < numBuffers; ++i) {
-            struct v4l2_buffer buf;
+/*
+ * DECIMATE_EVERY_NTH keeps one frame in value, DECIMATE_TARGET_FPS keeps the
+ * first frame due at value frames per second and DECIMATE_LATEST keeps the
+ * newest frame ready once one is due.  The fps modes also ask the driver to
+ * slow down, the driver timestamp check then only trims what it could not.
+ */
+void V4LStreamer::setDecimation(decimationMode mode, double value) {
+    switch (mode) {
+    case DECIMATE_EVERY_NTH:
+        if (value < 1)
+            throw IOException("Decimation factor must be at least 1");
+        decimateEvery = (unsigned int) value;
+        restoreCaptureRate();
+        break;
 
-            CLEAR (buf);
+    case DECIMATE_TARGET_FPS:
+    case DECIMATE_LATEST:
+        if (value <= 0)
+            throw IOException("Decimation rate must be positive");
+        decimatePeriod = (long long) (1000000.0 / value);
+        setCaptureRate(value);
+        break;
 
-            buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory      = V4L2_MEMORY_MMAP;
-            buf.index       = i;
+    case DECIMATE_NONE:
+        restoreCaptureRate();
+        break;
+    }
 
-            if (-1 == xioctl (cameraFD, VIDIOC_QBUF, &buf))
-                throw IOException("VIDIOC_QBUF error");
-        }
-                
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    decimation = mode;
+    frameCounter = 0;
+    nextDeadline = -1;
+}
 
-        if (-1 == xioctl (cameraFD, VIDIOC_STREAMON, &type))
-            throw IOException("VIDIOC_STREAMON error");
+decimationMode V4LStreamer::getDecimation() {
+    return decimation;
+}
 
-        break;
+StreamerMetrics &V4LStreamer::getMetrics() {
+    return metrics;
+}
 
-    case IO_METHOD_USERPTR:
-        for (i = 0; i < numBuffers; ++i) {
-            struct v4l2_buffer buf;
+void V4LStreamer::startCapture() {
+    if (STATUS_OK != tryStartCapture())
+        throw IOException(lastError);
+}
 
-            CLEAR (buf);
+streamerStatus V4LStreamer::tryStartCapture() {
+    enum v4l2_buf_type type;
 
-            buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory      = V4L2_MEMORY_USERPTR;
-            buf.index       = i;
-            buf.m.userptr   = (unsigned long) buffers[i].start;
-            buf.length      = buffers[i].length;
+    switch (io) {
+    case IO_METHOD_READ:
+        /* Nothing to do. */
+        break;
 
-            if (-1 == xioctl (cameraFD, VIDIOC_QBUF, &buf))
-                throw IOException("VIDIOC_QBUF error");
-            }
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        for (int i = 0; i < numBuffers; ++i) {
+            buffers[i].held = false;
+            if (-1 == queueBuffer(i))
+                return fail(STATUS_IO_ERROR, errno, "VIDIOC_QBUF", "VIDIOC_QBUF error");
+        }
 
-            type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        type = bufType;
 
-            if (-1 == xioctl (cameraFD, VIDIOC_STREAMON, &type))
-                throw IOException("VIDIOC_STREAMON error");
+        if (-1 == xioctl (cameraFD, VIDIOC_STREAMON, &type))
+            return fail(STATUS_IO_ERROR, errno, "VIDIOC_STREAMON", "VIDIOC_STREAMON error");
 
-            break;
-        }
+        break;
+    }
 
+    eioStreak = 0;
     streaming = true;
+    return STATUS_OK;
 }
 
 void V4LStreamer::stopCapture() {
+    if (STATUS_OK != tryStopCapture())
+        throw IOException(lastError);
+}
+
+streamerStatus V4LStreamer::tryStopCapture() {
     enum v4l2_buf_type type;
 
     switch (io) {
@@ -229,106 +469,332 @@ void V4LStreamer::stopCapture() {
 
     case IO_METHOD_MMAP:
     case IO_METHOD_USERPTR:
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        type = bufType;
 
         if (-1 == xioctl (cameraFD, VIDIOC_STREAMOFF, &type))
-            throw IOException("VIDIOC_STREAMOFF");
+            return fail(STATUS_IO_ERROR, errno, "VIDIOC_STREAMOFF", "VIDIOC_STREAMOFF");
 
         break;
     }
 
     streaming = false;
+    return STATUS_OK;
 }
 
 int V4LStreamer::readFrame(void *frame, int &bytesRead) {
+    switch (tryReadFrame(frame, bytesRead)) {
+    case STATUS_OK:
+        return 1;
+
+    case STATUS_AGAIN:
+    case STATUS_NOT_STREAMING:
+        return 0;
+
+    default:
+        throw IOException(lastError);
+    }
+}
+
+/*
+ * Non-throwing variant of readFrame().  Timeouts and transient driver errors
+ * come back as status codes with the details left in getLastError().
+ */
+streamerStatus V4LStreamer::tryReadFrame(void *frame, int &bytesRead) {
+    streamerStatus status;
     int retval;
+    unsigned long long start;
+    fd_set readFds;
     struct timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
 
-    retval = select(cameraFD+1, &fds, NULL, NULL, &tv);
-    if (retval == -1) {
-        if (errno != EINTR) 
-            throw IOException("Select error");
+    if (!streaming)
+        return fail(STATUS_NOT_STREAMING, 0, "read", "%s is not capturing", deviceName.c_str());
+
+    /* When decimating, keep waiting until a frame we want turns up. */
+    do {
+        readFds = fds;
+        tv.tv_sec = 2;
+        tv.tv_usec = 0;
+
+        start = StreamerMetrics::now();
+        retval = select(cameraFD+1, &readFds, NULL, NULL, &tv);
+        metrics.record(STAGE_SELECT, StreamerMetrics::now() - start);
+
+        if (retval == -1) {
+            if (errno != EINTR) {
+                metrics.count(COUNTER_SELECT_ERRORS);
+                return fail(STATUS_IO_ERROR, errno, "select", "Select error");
+            }
+        }
+
+        if (retval == 0) {
+            metrics.count(COUNTER_TIMEOUTS);
+            return fail(STATUS_TIMEOUT, 0, "select", "Select timeout");
+        }
+    
+        if (RGB) {
+            status = readRGB(frame, bytesRead);
+        } else {
+            status = readRaw(frame, bytesRead);
+        }
+    } while (status == STATUS_AGAIN && decimation != DECIMATE_NONE);
+
+    return status;
+}
+
+/*
+ * Dequeues the next filled buffer without copying it.  Returns 0 when no
+ * frame is ready yet; otherwise the view must be passed back to releaseFrame()
+ * before the buffer can be filled again.
+ */
+int V4LStreamer::dequeueFrame(frameView &view) {
+    switch (tryDequeueFrame(view)) {
+    case STATUS_OK:
+        return 1;
+
+    case STATUS_AGAIN:
+    case STATUS_NOT_STREAMING:
+        return 0;
+
+    default:
+        throw IOException(lastError);
     }
+}
+
+streamerStatus V4LStreamer::tryDequeueFrame(frameView &view) {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    struct timespec ts;
+    unsigned long long start;
+    unsigned int p;
+    int r;
+
+    if (!streaming)
+        return fail(STATUS_NOT_STREAMING, 0, "VIDIOC_DQBUF", "%s is not capturing", deviceName.c_str());
+
+    CLEAR (view);
+
+    if (io == IO_METHOD_READ) {
+        start = StreamerMetrics::now();
+        r = read (cameraFD, buffers[0].planes[0].start, buffers[0].planes[0].length);
+        metrics.record(STAGE_READ, StreamerMetrics::now() - start);
 
-    if (retval == 0) {
-        throw IOException("Select timeout");
+        if (-1 == r) {
+            switch (errno) {
+            case EAGAIN:
+                metrics.count(COUNTER_EAGAIN);
+                return STATUS_AGAIN;
+
+            case EIO:
+                /* Transient for read(), see spec; just try again. */
+                metrics.count(COUNTER_EIO);
+                return STATUS_AGAIN;
+
+            default:
+                return fail(STATUS_IO_ERROR, errno, "read", "Read error");
+            }
+        }
+
+        /* read() gives no driver timestamp, so stamp it on arrival. */
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        view.timestamp.tv_sec = ts.tv_sec;
+        view.timestamp.tv_usec = ts.tv_nsec / 1000;
+        view.index = 0;
+        view.numPlanes = 1;
+        view.planes[0].data = (const unsigned char *) buffers[0].planes[0].start;
+        view.planes[0].bytesUsed = r;
+        view.planes[0].bytesPerLine = getBytesPerLine();
+
+        metrics.count(COUNTER_FRAMES);
+        return STATUS_OK;
     }
-    
-    if (RGB) {
-        readRGB(frame, bytesRead);
+
+    CLEAR (buf);
+    buf.type = bufType;
+    buf.memory = (io == IO_METHOD_MMAP) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+    buf.index = numBuffers;
+
+    if (isMultiPlanar()) {
+        CLEAR (planes);
+        buf.m.planes = planes;
+        buf.length = numPlanes;
+    }
+
+    start = StreamerMetrics::now();
+    r = xioctl (cameraFD, VIDIOC_DQBUF, &buf);
+    metrics.record(STAGE_DQBUF, StreamerMetrics::now() - start);
+
+    if (-1 == r) {
+        switch (errno) {
+        case EAGAIN:
+            metrics.count(COUNTER_EAGAIN);
+            return STATUS_AGAIN;
+
+        case EIO:
+            /* The driver may still have handed us the buffer, see spec. */
+            metrics.count(COUNTER_EIO);
+            if ((int)buf.index < numBuffers)
+                queueBuffer(buf.index);
+            return recoverStream();
+
+        default:
+            return fail(STATUS_IO_ERROR, errno, "VIDIOC_DQBUF", "VIDIOC_DQBUF");
+        }
+    }
+
+    if ((int)buf.index >= numBuffers)
+        return fail(STATUS_IO_ERROR, 0, "VIDIOC_DQBUF", "Invalid buffer number");
+
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        metrics.count(COUNTER_EIO);
+        if (-1 == queueBuffer(buf.index))
+            return fail(STATUS_IO_ERROR, errno, "VIDIOC_QBUF", "VIDIOC_QBUF error");
+        return recoverStream();
+    }
+
+    eioStreak = 0;
+    buffers[buf.index].held = true;
+
+    view.index = buf.index;
+    view.numPlanes = numPlanes;
+    view.timestamp = buf.timestamp;
+    view.sequence = buf.sequence;
+
+    if (isMultiPlanar()) {
+        for (p = 0; p < numPlanes; ++p) {
+            unsigned int offset = (io == IO_METHOD_MMAP) ? planes[p].data_offset : 0;
+
+            view.planes[p].data = (const unsigned char *) buffers[buf.index].planes[p].start + offset;
+            view.planes[p].bytesUsed = planes[p].bytesused - offset;
+            view.planes[p].bytesPerLine = fmt.fmt.pix_mp.plane_fmt[p].bytesperline;
+        }
     } else {
-        readRaw(frame, bytesRead);
+        view.planes[0].data = (const unsigned char *) buffers[buf.index].planes[0].start;
+        view.planes[0].bytesUsed = buf.bytesused;
+        view.planes[0].bytesPerLine = fmt.fmt.pix.bytesperline;
+    }
+
+    metrics.count(COUNTER_FRAMES);
+    return STATUS_OK;
+}
+
+void V4LStreamer::releaseFrame(const frameView &view) {
+    switch (tryReleaseFrame(view)) {
+    case STATUS_OK:
+    case STATUS_NOT_STREAMING:
+        break;
+
+    default:
+        throw IOException(lastError);
     }
 }
 
+streamerStatus V4LStreamer::tryReleaseFrame(const frameView &view) {
+    if (io == IO_METHOD_READ)
+        return STATUS_OK;
+
+    buffers[view.index].held = false;
+
+    /* STREAMOFF already took the buffer back; startCapture() will queue it. */
+    if (!streaming)
+        return fail(STATUS_NOT_STREAMING, 0, "VIDIOC_QBUF", "%s is not capturing", deviceName.c_str());
+
+    if (-1 == queueBuffer(view.index))
+        return fail(STATUS_IO_ERROR, errno, "VIDIOC_QBUF", "VIDIOC_QBUF error");
+    return STATUS_OK;
+}
+
+const streamerError &V4LStreamer::getLastError() {
+    return lastError;
+}
+
 void V4LStreamer::initDevice(int height, int width, int channel, unsigned int pixelFormat, v4l2_field field, v4l2_std_id std) {
-    unsigned int min;
+    unsigned int min, caps;
+    bool cropProbed, cropSupported;
+    char rdev[32];
     struct stat st; 
 
     if (-1 == stat (deviceName.c_str(), &st)) {
-        char *message = new char[256];
-        sprintf(message, "Cannot identify device '%s': %d, %s", deviceName.c_str(), errno, strerror(errno));
-        throw IOException(message);
+        fail(STATUS_IO_ERROR, errno, "stat", "Cannot identify device '%s': %d, %s", deviceName.c_str(), errno, strerror(errno));
+        throw IOException(lastError);
     }
 
     if (!S_ISCHR(st.st_mode)) {
-        char *message = new char[256];
-        sprintf(message, "%s is not a character device", deviceName.c_str());
-        throw IOException(message);
+        fail(STATUS_UNSUPPORTED, 0, "stat", "%s is not a character device", deviceName.c_str());
+        throw IOException(lastError);
     }
 
     cameraFD = open(deviceName.c_str(), O_RDWR /* required */ | O_NONBLOCK, 0);
 
     if (-1 == cameraFD) {
-        char *message = new char[256];
-        sprintf(message, "Cannot open '%s': %d, %s", deviceName.c_str(), errno, strerror(errno));
-        throw IOException(message);
+        fail(STATUS_IO_ERROR, errno, "open", "Cannot open '%s': %d, %s", deviceName.c_str(), errno, strerror(errno));
+        throw IOException(lastError);
     }
     
     if (-1 == xioctl (cameraFD, VIDIOC_QUERYCAP, &cap)) {
         if (EINVAL == errno) {
-            char *message = new char[256];
-            sprintf(message, "%s is not a V4L2 device", deviceName.c_str());
-            throw IOException(message);
+            fail(STATUS_UNSUPPORTED, errno, "VIDIOC_QUERYCAP", "%s is not a V4L2 device", deviceName.c_str());
+            throw IOException(lastError);
         } else {
             throw IOException("VIDIOC_QUERYCAP error");
         }
     }
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        char *message = new char[256];
-        sprintf(message, "%s is not a video capture device", deviceName.c_str());
-        throw IOException(message);
+    caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+
+    /* Prefer the single-planar API, fall back to multi-planar only devices. */
+    if (caps & V4L2_CAP_VIDEO_CAPTURE) {
+        bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    } else if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+        bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    } else {
+        fail(STATUS_UNSUPPORTED, 0, "VIDIOC_QUERYCAP", "%s is not a video capture device", deviceName.c_str());
+        throw IOException(lastError);
     }
 
     switch (io) {
     case IO_METHOD_READ:
         if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-            char *message = new char[256];
-            sprintf(message, "%s does not support read i/o", deviceName.c_str());
-            throw IOException(message);
+            fail(STATUS_UNSUPPORTED, 0, "VIDIOC_QUERYCAP", "%s does not support read i/o", deviceName.c_str());
+            throw IOException(lastError);
         }
         break;
 
     case IO_METHOD_MMAP:
     case IO_METHOD_USERPTR:
         if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-            char *message = new char[256];
-            sprintf(message, "%s does not support streaming i/o", deviceName.c_str());
-            throw IOException(message);
+            fail(STATUS_UNSUPPORTED, 0, "VIDIOC_QUERYCAP", "%s does not support streaming i/o", deviceName.c_str());
+            throw IOException(lastError);
         }
 
         break;
     }
 
+    snprintf(rdev, sizeof(rdev), ":%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    profileKey = string((const char *) cap.driver) + ":" + (const char *) cap.card + ":" + (const char *) cap.bus_info + rdev;
+
     /* Select video input, video standard and tune here. */
 
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    pthread_mutex_lock(&profilesLock);
+    deviceProfile &profile = profiles[profileKey];
+    cropProbed = profile.cropProbed;
+    cropSupported = profile.cropSupported;
+    cropcap = profile.cropcap;
+    pthread_mutex_unlock(&profilesLock);
+
+    if (!cropProbed) {
+        CLEAR (cropcap);
+        cropcap.type = bufType;
+        cropSupported = (0 == xioctl (cameraFD, VIDIOC_CROPCAP, &cropcap));
+
+        pthread_mutex_lock(&profilesLock);
+        profiles[profileKey].cropProbed = true;
+        profiles[profileKey].cropSupported = cropSupported;
+        profiles[profileKey].cropcap = cropcap;
+        pthread_mutex_unlock(&profilesLock);
+    }
 
-    if (0 == xioctl (cameraFD, VIDIOC_CROPCAP, &cropcap)) {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (cropSupported) {
+        crop.type = bufType;
         crop.c = cropcap.defrect; /* reset to default */
 
         if (-1 == xioctl (cameraFD, VIDIOC_S_CROP, &crop)) {
@@ -345,21 +811,37 @@ void V4LStreamer::initDevice(int height, int width, int channel, unsigned int pi
         /* Errors ignored. */
     }
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    setPixelFormat(pixelFormat);
-    setField(field);
-    setResolution(width, height);
+    /*
+     * S_INPUT and S_STD may reset the format to the input's default, so they
+     * go first and the format is applied last.
+     */
     setChannel(channel);
     if (std > 0) {
     	setStd(std);
     }
+    fmt.type = bufType;
+    applyFormat(width, height, pixelFormat, field);
 
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min)
-            fmt.fmt.pix.bytesperline = min;
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min)
-        fmt.fmt.pix.sizeimage = min;
+    if (isMultiPlanar()) {
+        numPlanes = fmt.fmt.pix_mp.num_planes;
+
+        /* Default the YUV matrix and range to whatever the driver negotiated. */
+        converter.setFromFormat(fmt.fmt.pix_mp.colorspace, fmt.fmt.pix_mp.ycbcr_enc, fmt.fmt.pix_mp.quantization);
+    } else {
+        numPlanes = 1;
+
+        if (isPacked422(fmt.fmt.pix.pixelformat)) {
+            min = fmt.fmt.pix.width * 2;
+            if (fmt.fmt.pix.bytesperline < min)
+                fmt.fmt.pix.bytesperline = min;
+            min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+            if (fmt.fmt.pix.sizeimage < min)
+                fmt.fmt.pix.sizeimage = min;
+        }
+
+        /* Default the YUV matrix and range to whatever the driver negotiated. */
+        converter.setFromFormat(fmt.fmt.pix.colorspace, fmt.fmt.pix.ycbcr_enc, fmt.fmt.pix.quantization);
+    }
 
     initIO();
 }
@@ -391,16 +873,18 @@ void V4LStreamer::initIO() {
 }
 
 void V4LStreamer::initRead() {
-    unsigned int bufferSize = fmt.fmt.pix.sizeimage;
+    unsigned int bufferSize = getImageSize();
     buffers = (buffer*)calloc (1, sizeof (*buffers));
 
     if (!buffers)
         throw bad_alloc();
 
-    buffers[0].length = bufferSize;
-    buffers[0].start = malloc(bufferSize);
+    /* read() hands back all planes packed into a single buffer. */
+    numBuffers = 1;
+    buffers[0].planes[0].length = bufferSize;
+    buffers[0].planes[0].start = malloc(bufferSize);
 
-    if (!buffers[0].start) 
+    if (!buffers[0].planes[0].start) 
         throw bad_alloc();
 }
 
@@ -410,23 +894,21 @@ void V4LStreamer::initMMAP() {
     CLEAR (req);
 
     req.count               = numBuffers;
-    req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.type                = bufType;
     req.memory              = V4L2_MEMORY_MMAP;
 
     if (-1 == xioctl (cameraFD, VIDIOC_REQBUFS, &req)) {
         if (EINVAL == errno) {
-            char *message = new char[256];
-            sprintf(message, "%s does not support memory mapping", deviceName.c_str());
-            throw IOException(message);
+            fail(STATUS_UNSUPPORTED, errno, "VIDIOC_REQBUFS", "%s does not support memory mapping", deviceName.c_str());
+            throw IOException(lastError);
         } else {
             throw IOException("VIDIOC_REQBUFS");
         }
     }
 
     if (req.count < 2) {
-        char *message = new char[256];
-        sprintf(message, "Insufficient buffer memory on %s", deviceName.c_str());
-        throw IOException(message);
+        fail(STATUS_IO_ERROR, 0, "VIDIOC_REQBUFS", "Insufficient buffer memory on %s", deviceName.c_str());
+        throw IOException(lastError);
     }
 
     buffers = (buffer*)calloc (req.count, sizeof (*buffers));
@@ -435,50 +917,62 @@ void V4LStreamer::initMMAP() {
         throw bad_alloc();
     }
 
+    /* The driver may have given us more or fewer buffers than asked for. */
+    numBuffers = req.count;
+
     for (int n_buffers = 0; n_buffers < (int)req.count; ++n_buffers) {
         struct v4l2_buffer buf;
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
 
         CLEAR (buf);
+        CLEAR (planes);
 
-        buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.type        = bufType;
         buf.memory      = V4L2_MEMORY_MMAP;
         buf.index       = n_buffers;
 
+        if (isMultiPlanar()) {
+            buf.m.planes = planes;
+            buf.length   = numPlanes;
+        }
+
         if (-1 == xioctl (cameraFD, VIDIOC_QUERYBUF, &buf))
             throw IOException("VIDIOC_QUERYBUF");
 
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start =
-            mmap (NULL /* start anywhere */,
-                buf.length,
-                PROT_READ | PROT_WRITE /* required */,
-                MAP_SHARED /* recommended */,
-                cameraFD, buf.m.offset);
+        for (unsigned int p = 0; p < numPlanes; ++p) {
+            size_t length = isMultiPlanar() ? planes[p].length : buf.length;
+            off_t offset = isMultiPlanar() ? planes[p].m.mem_offset : buf.m.offset;
 
-        if (MAP_FAILED == buffers[n_buffers].start)
-            throw IOException("MMAP failed");
+            buffers[n_buffers].planes[p].length = length;
+            buffers[n_buffers].planes[p].start =
+                mmap (NULL /* start anywhere */,
+                    length,
+                    PROT_READ | PROT_WRITE /* required */,
+                    MAP_SHARED /* recommended */,
+                    cameraFD, offset);
+
+            if (MAP_FAILED == buffers[n_buffers].planes[p].start)
+                throw IOException("MMAP failed");
+        }
     }
 }
 
 void V4LStreamer::initUserPtr() {
-    unsigned int bufferSize = fmt.fmt.pix.sizeimage;
     struct v4l2_requestbuffers req;
     unsigned int pageSize;
 
     pageSize = getpagesize ();
-    bufferSize = (bufferSize + pageSize - 1) & ~(pageSize - 1);
 
     CLEAR (req);
 
     req.count               = numBuffers;
-    req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.type                = bufType;
     req.memory              = V4L2_MEMORY_USERPTR;
 
     if (-1 == xioctl (cameraFD, VIDIOC_REQBUFS, &req)) {
         if (EINVAL == errno) {
-            char *message = new char[256];
-            sprintf(message, "%s does not support user pointer i/o", deviceName.c_str());
-            throw IOException(message);
+            fail(STATUS_UNSUPPORTED, errno, "VIDIOC_REQBUFS", "%s does not support user pointer i/o", deviceName.c_str());
+            throw IOException(lastError);
         } else {
             throw IOException("VIDIOC_REQBUFS");
         }
@@ -490,185 +984,322 @@ void V4LStreamer::initUserPtr() {
         throw bad_alloc();
     }
 
+    numBuffers = req.count;
+
     for (int n_buffers = 0; n_buffers < (int)req.count; ++n_buffers) {
-        buffers[n_buffers].length = bufferSize;
-        buffers[n_buffers].start = memalign (/* boundary */ pageSize, bufferSize);
+        for (unsigned int p = 0; p < numPlanes; ++p) {
+            unsigned int bufferSize = isMultiPlanar() ? fmt.fmt.pix_mp.plane_fmt[p].sizeimage : fmt.fmt.pix.sizeimage;
+
+            bufferSize = (bufferSize + pageSize - 1) & ~(pageSize - 1);
+            buffers[n_buffers].planes[p].length = bufferSize;
+            buffers[n_buffers].planes[p].start = memalign (/* boundary */ pageSize, bufferSize);
 
-        if (!buffers[n_buffers].start) {
-            throw bad_alloc();
+            if (!buffers[n_buffers].planes[p].start) {
+                throw bad_alloc();
+            }
         }
     }
 }
 
-int V4LStreamer::xioctl(int fd, int request, void *arg) {
-    int r;
+void V4LStreamer::freeBuffers() {
+    int i;
+    unsigned int p;
 
-    do r = ioctl (fd, request, arg);
-    while (-1 == r && EINTR == errno);
-    
-    return r;
+    if (!buffers)
+        return;
+
+    switch (io) {
+    case IO_METHOD_READ:
+        free (buffers[0].planes[0].start);
+        break;
+
+    case IO_METHOD_MMAP:
+        for (i = 0; i < numBuffers; ++i)
+            for (p = 0; p < numPlanes; ++p)
+                if (-1 == munmap (buffers[i].planes[p].start, buffers[i].planes[p].length))
+                    throw IOException("munmap");
+        break;
+
+    case IO_METHOD_USERPTR:
+        for (i = 0; i < numBuffers; ++i)
+            for (p = 0; p < numPlanes; ++p)
+                free (buffers[i].planes[p].start);
+        break;
+    }
+
+    free (buffers);
+    buffers = NULL;
 }
 
-void V4LStreamer::YUYVTORGB24(int width, int height, unsigned char *src, unsigned char *dst) {
-    unsigned char *s;
-    unsigned char *d;
-    int l, c;
-    int r, g, b, cr, cg, cb, y1, y2;
-
-    l = height;
-    s = src;
-    d = dst;
-    while (l--) {
-        c = width >> 1;
-        while (c--) {
-            y1 = *s++;
-            cb = ((*s - 128) * 454) >> 8;
-            cg = (*s++ - 128) * 88;
-            y2 = *s++;
-            cr = ((*s - 128) * 359) >> 8;
-            cg = (cg + (*s++ - 128) * 183) >> 8;
-
-            r = y1 + cr;
-            b = y1 + cb;
-            g = y1 - cg;
-            SAT(r);
-            SAT(g);
-            SAT(b);
-
-            *d++ = b;
-            *d++ = g;
-            *d++ = r;
-
-            r = y2 + cr;
-            b = y2 + cb;
-            g = y2 - cg;
-            SAT(r);
-            SAT(g);
-            SAT(b);
-
-            *d++ = b;
-            *d++ = g;
-            *d++ = r;
+/* Returns the raw ioctl result so callers decide how to report failure. */
+int V4LStreamer::queueBuffer(int index) {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    unsigned long long start;
+    unsigned int p;
+    int r;
+
+    CLEAR (buf);
+    CLEAR (planes);
+
+    buf.type        = bufType;
+    buf.memory      = (io == IO_METHOD_MMAP) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+    buf.index       = index;
+
+    if (isMultiPlanar()) {
+        buf.m.planes = planes;
+        buf.length   = numPlanes;
+
+        if (io == IO_METHOD_USERPTR) {
+            for (p = 0; p < numPlanes; ++p) {
+                planes[p].m.userptr = (unsigned long) buffers[index].planes[p].start;
+                planes[p].length    = buffers[index].planes[p].length;
+            }
         }
+    } else if (io == IO_METHOD_USERPTR) {
+        buf.m.userptr   = (unsigned long) buffers[index].planes[0].start;
+        buf.length      = buffers[index].planes[0].length;
     }
+
+    start = StreamerMetrics::now();
+    r = xioctl (cameraFD, VIDIOC_QBUF, &buf);
+    metrics.record(STAGE_QBUF, StreamerMetrics::now() - start);
+
+    return r;
 }
 
-int V4LStreamer::readRaw(void *frame, int &bytesRead) {
-    if (streaming) {
-        struct v4l2_buffer buf;
-        unsigned int i;
+/*
+ * Called after the driver reported an i/o error on a buffer.  Isolated errors
+ * are treated like EAGAIN; a run of them restarts streaming, which returns
+ * every buffer to us so the set can be queued afresh.  Buffers the caller
+ * still holds as a frameView are left alone and go back to the driver when
+ * they are released.
+ */
+streamerStatus V4LStreamer::recoverStream() {
+    enum v4l2_buf_type type = bufType;
 
-        switch (io) {
-        case IO_METHOD_READ:
-            if (-1 == read (cameraFD, buffers[0].start, buffers[0].length)) {
-                switch (errno) {
-                case EAGAIN:
-                    return 0;
+    if (++eioStreak < EIO_RESTART_THRESHOLD)
+        return STATUS_AGAIN;
 
-                case EIO:
-                    /* Could ignore EIO, see spec. */
-                    /* fall through */
+    eioStreak = 0;
 
-                default:
-                    throw IOException("Read error");
-                }
-            }
-        
-            memcpy(frame, buffers[0].start, fmt.fmt.pix.sizeimage);
-            bytesRead = buffers[0].length;
-            break;
+    if (-1 == xioctl (cameraFD, VIDIOC_STREAMOFF, &type))
+        return fail(STATUS_IO_ERROR, errno, "VIDIOC_STREAMOFF", "EIO recovery failed to stop streaming");
 
-        case IO_METHOD_MMAP:
-            CLEAR (buf);
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_MMAP;
+    for (int i = 0; i < numBuffers; ++i)
+        if (!buffers[i].held && -1 == queueBuffer(i))
+            return fail(STATUS_IO_ERROR, errno, "VIDIOC_QBUF", "EIO recovery failed to queue buffers");
 
-            if (-1 == xioctl (cameraFD, VIDIOC_DQBUF, &buf)) {
-                switch (errno) {
-                case EAGAIN:
-                    return 0;
+    if (-1 == xioctl (cameraFD, VIDIOC_STREAMON, &type))
+        return fail(STATUS_IO_ERROR, errno, "VIDIOC_STREAMON", "EIO recovery failed to restart streaming");
 
-                case EIO:
-                    /* Could ignore EIO, see spec. */
-                    /* fall through */
+    return STATUS_AGAIN;
+}
 
-                default:
-                    throw IOException("VIDIOC_DQBUF");
-                }
-            }
+/*
+ * Fills in the preallocated error descriptor.  With no format the message is
+ * just the operation and strerror() of the captured errno.
+ */
+streamerStatus V4LStreamer::fail(streamerStatus status, int err, const char *operation, const char *format, ...) {
+    va_list args;
+
+    lastError.status = status;
+    lastError.sysErrno = err;
+    lastError.operation = operation;
+
+    if (format) {
+        va_start(args, format);
+        vsnprintf(lastError.message, sizeof(lastError.message), format, args);
+        va_end(args);
+    } else {
+        snprintf(lastError.message, sizeof(lastError.message), "%s: %s", operation, strerror(err));
+    }
 
-            if ((int)buf.index > numBuffers)
-                throw IOException("Invalid buffer number");
-       
-            memcpy(frame, buffers[buf.index].start, fmt.fmt.pix.sizeimage);
-            bytesRead = buf.length;
+    return status;
+}
 
-            if (-1 == xioctl (cameraFD, VIDIOC_QBUF, &buf))
-                throw IOException("VIDIOC_QBUF");
+/*
+ * Best effort: plenty of drivers have no frame interval control or refuse it
+ * while streaming, in which case decimation is left entirely to keepFrame().
+ */
+void V4LStreamer::setCaptureRate(double fps) {
+    struct v4l2_streamparm parm;
 
-            break;
+    CLEAR (parm);
+    parm.type = bufType;
 
-        case IO_METHOD_USERPTR:
-            CLEAR (buf);
+    if (-1 == xioctl (cameraFD, VIDIOC_G_PARM, &parm))
+        return;
+    if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+        return;
 
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_USERPTR;
+    if (!rateLowered)
+        savedTimePerFrame = parm.parm.capture.timeperframe;
 
-            if (-1 == xioctl (cameraFD, VIDIOC_DQBUF, &buf)) {
-                switch (errno) {
-                case EAGAIN:
-                    return 0;
+    parm.parm.capture.timeperframe.numerator = 1000;
+    parm.parm.capture.timeperframe.denominator = (unsigned int) (fps * 1000.0);
 
-                case EIO:
-                    /* Could ignore EIO, see spec. */
-                    /* fall through */
+    if (0 == xioctl (cameraFD, VIDIOC_S_PARM, &parm))
+        rateLowered = true;
+}
 
-                default:
-                    throw IOException("VIDIOC_DQBUF");
-                }
-            }
+void V4LStreamer::restoreCaptureRate() {
+    struct v4l2_streamparm parm;
 
-            for (i = 0; (int)i < numBuffers; ++i)
-                if (buf.m.userptr == (unsigned long) buffers[i].start && buf.length == buffers[i].length)
-                    break;
-        
-            if ((int)i > numBuffers)
-                throw IOException("Invalid buffer number");
+    if (!rateLowered)
+        return;
 
-            memcpy(frame, (void *) buf.m.userptr, fmt.fmt.pix.sizeimage);
-            bytesRead = buf.length;
+    CLEAR (parm);
+    parm.type = bufType;
+    parm.parm.capture.timeperframe = savedTimePerFrame;
 
-            if (-1 == xioctl (cameraFD, VIDIOC_QBUF, &buf))
-                throw IOException("VIDIOC_QBUF");
+    if (0 == xioctl (cameraFD, VIDIOC_S_PARM, &parm))
+        rateLowered = false;
+}
 
-            break;
+/*
+ * Deadlines advance by whole periods so the average output rate matches the
+ * target, and a quarter period of slack absorbs timestamp jitter.
+ */
+bool V4LStreamer::keepFrame(const frameView &view) {
+    long long ts;
+
+    switch (decimation) {
+    case DECIMATE_EVERY_NTH:
+        return (frameCounter++ % decimateEvery) == 0;
+
+    case DECIMATE_TARGET_FPS:
+    case DECIMATE_LATEST:
+        ts = (long long) view.timestamp.tv_sec * 1000000 + view.timestamp.tv_usec;
+
+        if (nextDeadline >= 0 && ts + decimatePeriod / 4 < nextDeadline)
+            return false;
+
+        if (nextDeadline < 0 || ts - nextDeadline >= decimatePeriod)
+            nextDeadline = ts + decimatePeriod;
+        else
+            nextDeadline += decimatePeriod;
+        return true;
+
+    case DECIMATE_NONE:
+    default:
+        return true;
+    }
+}
+
+/*
+ * Like dequeueFrame() but applies the decimation policy.  Skipped buffers go
+ * straight back to the driver without being copied or converted.
+ */
+streamerStatus V4LStreamer::nextFrame(frameView &view) {
+    streamerStatus status;
+    frameView newer;
+
+    while (STATUS_OK == (status = tryDequeueFrame(view))) {
+        if (keepFrame(view)) {
+            if (decimation == DECIMATE_LATEST && io != IO_METHOD_READ) {
+                while (STATUS_OK == tryDequeueFrame(newer)) {
+                    if (STATUS_OK != (status = tryReleaseFrame(view)))
+                        return status;
+                    metrics.count(COUNTER_DECIMATED);
+                    view = newer;
+                }
+            }
+            return STATUS_OK;
         }
 
-        return 1;
+        if (STATUS_OK != (status = tryReleaseFrame(view)))
+            return status;
+        metrics.count(COUNTER_DECIMATED);
     }
-    return 0;
 
+    return status;
 }
 
-int V4LStreamer::readRGB(void *frame, int &bytesRead) {
-    if (streaming) {
-        int retval;
-        void *tmp = malloc(fmt.fmt.pix.sizeimage);
-        retval = readRaw(tmp, bytesRead);
+int V4LStreamer::xioctl(int fd, int request, void *arg) {
+    int r;
 
-        switch(fmt.fmt.pix.pixelformat) {
-        case V4L2_PIX_FMT_YUYV:
-            YUYVTORGB24(fmt.fmt.pix.width, fmt.fmt.pix.height, (unsigned char*) tmp, (unsigned char*) frame);
-            break;
-        
-        default:
-            throw IOException("Unsupported pixel format conversion");
-        };
-        
-        bytesRead = fmt.fmt.pix.width * fmt.fmt.pix.height * 3;
-	free(tmp);
-        return retval;
+    do r = ioctl (fd, request, arg);
+    while (-1 == r && EINTR == errno);
+    
+    return r;
+}
+
+streamerStatus V4LStreamer::readRaw(void *frame, int &bytesRead) {
+    streamerStatus status;
+    frameView view;
+    unsigned char *dst = (unsigned char *) frame;
+    unsigned long long start;
+
+    if (STATUS_OK != (status = nextFrame(view)))
+        return status;
+
+    /* Planes are packed back to back, which for NV12M gives plain NV12. */
+    start = StreamerMetrics::now();
+    bytesRead = 0;
+    for (unsigned int p = 0; p < view.numPlanes; ++p) {
+        memcpy(dst + bytesRead, view.planes[p].data, view.planes[p].bytesUsed);
+        bytesRead += view.planes[p].bytesUsed;
     }
-    return 0;
+    metrics.record(STAGE_COPY, StreamerMetrics::now() - start);
+
+    return tryReleaseFrame(view);
+}
+
+streamerStatus V4LStreamer::readRGB(void *frame, int &bytesRead) {
+    streamerStatus status, converted;
+    frameView view;
+    int width, height;
+
+    if (STATUS_OK != (status = nextFrame(view)))
+        return status;
+
+    converted = convertFrame(view, (unsigned char *) frame);
+
+    if (STATUS_OK != (status = tryReleaseFrame(view)))
+        return status;
+    if (STATUS_OK != converted)
+        return converted;
+
+    getResolution(width, height);
+    bytesRead = width * height * 3;
+    return STATUS_OK;
 }
 
+/*
+ * Converts straight out of the capture buffers, so planar formats are read
+ * from their own planes with no intermediate copy.
+ */
+streamerStatus V4LStreamer::convertFrame(const frameView &view, unsigned char *dst) {
+    const unsigned char *uv;
+    unsigned int uvStride;
+    unsigned long long start;
+    int width, height;
+
+    getResolution(width, height);
+
+    start = StreamerMetrics::now();
+    switch (getPixelFormat()) {
+    case V4L2_PIX_FMT_YUYV:
+        converter.YUYVToRGB24(width, height, view.planes[0].data, view.planes[0].bytesPerLine, dst);
+        break;
+
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+        if (view.numPlanes > 1) {
+            uv = view.planes[1].data;
+            uvStride = view.planes[1].bytesPerLine;
+        } else {
+            uv = view.planes[0].data + view.planes[0].bytesPerLine * height;
+            uvStride = view.planes[0].bytesPerLine;
+        }
+        converter.NV12ToRGB24(width, height, view.planes[0].data, view.planes[0].bytesPerLine, uv, uvStride, dst);
+        break;
+
+    default:
+        return fail(STATUS_UNSUPPORTED, 0, "convert", "Unsupported pixel format conversion");
+    };
+    metrics.record(STAGE_CONVERT, StreamerMetrics::now() - start);
+
+    return STATUS_OK;
+}
@@ -5,6 +5,10 @@
 #include <linux/videodev2.h>
 #include <sys/select.h>
 
+#include "ColorConverter.h"
+#include "StreamerError.h"
+#include "StreamerMetrics.h"
+
 using namespace std;
 
 
@@ -14,6 +18,13 @@ enum ioMethod {
     IO_METHOD_USERPTR
 };
 
+enum decimationMode {
+    DECIMATE_NONE,
+    DECIMATE_EVERY_NTH,
+    DECIMATE_TARGET_FPS,
+    DECIMATE_LATEST
+};
+
 /*
 enum pixelFormat {
     GREY = V4L2_PIX_FMT_GREY,
@@ -21,11 +32,39 @@ enum pixelFormat {
 };
 */
 
-struct buffer {
+struct plane {
     void *start;
     size_t length;
 };
 
+/*
+ * Single-planar buffers only use planes[0].  held is set while the buffer is
+ * out with the caller as a frameView.
+ */
+struct buffer {
+    struct plane planes[VIDEO_MAX_PLANES];
+    bool held;
+};
+
+struct planeView {
+    const unsigned char *data;
+    unsigned int bytesUsed;
+    unsigned int bytesPerLine;
+};
+
+/*
+ * Zero-copy view of a dequeued buffer.  The plane pointers reference the
+ * capture buffers directly and stay valid until the frame is handed back with
+ * releaseFrame().
+ */
+struct frameView {
+    int index;
+    unsigned int numPlanes;
+    struct planeView planes[VIDEO_MAX_PLANES];
+    struct timeval timestamp;
+    unsigned int sequence;
+};
+
 class V4LStreamer {
 public:
     V4LStreamer(ioMethod io, string deviceName, bool RGB, int width, int height, int channel, int numBuffers, unsigned int pixelFormat, v4l2_field field, v4l2_std_id std);
@@ -38,24 +77,58 @@ public:
     int getChannel();
     void setStd(v4l2_std_id std);
     v4l2_std_id getStd();
+    void applyFormat(int width, int height, unsigned int pixelFormat, v4l2_field field);
     void setPixelFormat(unsigned int format);
     int getPixelFormat();
     void setField(v4l2_field field);
     v4l2_field getField();
+    void setColorMatrix(colorMatrix matrix);
+    colorMatrix getColorMatrix();
+    void setColorRange(colorRange range);
+    colorRange getColorRange();
+    void setConversionThreads(int numThreads);
+    int getConversionThreads();
     //void setNumBuffers(int numBuffers);
     int getNumbuffers();
+    int getFileDescriptor();
     int getImageSize();
     int getBytesPerLine();
+    bool isMultiPlanar();
+    int getNumPlanes();
+    void setDecimation(decimationMode mode, double value);
+    decimationMode getDecimation();
+    StreamerMetrics &getMetrics();
     void startCapture();
     void stopCapture();
     int readFrame(void *frame, int &bytesRead);
+    int dequeueFrame(frameView &view);
+    void releaseFrame(const frameView &view);
+    streamerStatus tryStartCapture();
+    streamerStatus tryStopCapture();
+    streamerStatus tryReadFrame(void *frame, int &bytesRead);
+    streamerStatus tryDequeueFrame(frameView &view);
+    streamerStatus tryReleaseFrame(const frameView &view);
+    const streamerError &getLastError();
+    static void flushDeviceCache();
 
 private:
     bool streaming;
     int cameraFD;
     bool RGB;
     int numBuffers;
+    unsigned int numPlanes;
+    v4l2_buf_type bufType;
+    decimationMode decimation;
+    unsigned int decimateEvery;
+    long long decimatePeriod;
+    long long nextDeadline;
+    unsigned long long frameCounter;
+    bool rateLowered;
+    struct v4l2_fract savedTimePerFrame;
+    unsigned int eioStreak;
+    streamerError lastError;
     string deviceName;
+    string profileKey;
     fd_set fds;
     ioMethod io;
     struct buffer *buffers;
@@ -64,6 +137,9 @@ private:
     struct v4l2_crop crop;
     struct v4l2_format fmt;
     struct v4l2_input input;
+    ColorConverter converter;
+    WorkerPool *conversionPool;
+    StreamerMetrics metrics;
 
 private:
     void initDevice(int height, int width, int channel, unsigned int pixelFormat, v4l2_field field, v4l2_std_id std);
@@ -72,10 +148,18 @@ private:
     void initRead();
     void initMMAP();
     void initUserPtr();
+    void freeBuffers();
+    int queueBuffer(int index);
+    streamerStatus recoverStream();
+    streamerStatus fail(streamerStatus status, int err, const char *operation, const char *format, ...);
+    void setCaptureRate(double fps);
+    void restoreCaptureRate();
+    bool keepFrame(const frameView &view);
+    streamerStatus nextFrame(frameView &view);
+    streamerStatus convertFrame(const frameView &view, unsigned char *dst);
     int xioctl(int fd, int request, void *arg);
-    void YUYVTORGB24(int width, int height, unsigned char *src, unsigned char *dst);
-    int readRaw(void *frame, int &bytesRead);
-    int readRGB(void *frame, int &bytesRead);
+    streamerStatus readRaw(void *frame, int &bytesRead);
+    streamerStatus readRGB(void *frame, int &bytesRead);
 };
 
 #endif